@@ -0,0 +1,256 @@
+#include <string.h>
+
+#include "color.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FIX(x) ((int)((x) * 65536.0 + 0.5))
+#define ROUND (1 << 15)
+/* (y_tab + chroma) >> 16 stays inside -384..639 for every matrix and range */
+#define CLIP_OFFSET 384
+
+static inline unsigned char clip(int value);
+static inline void put_pixel(unsigned char *out, int bgrx, int r, int g, int b);
+static inline void scalar_convert(const color_conv *cc, const unsigned char *in,
+                                  unsigned char *out, int pixels, int bgrx);
+static inline void lut_convert(const color_conv *cc, const unsigned char *in,
+                               unsigned char *out, int pixels, int bgrx);
+
+static inline unsigned char clip(int value)
+{
+    return (value > 255 ? 255 : (value < 0 ? 0 : value));
+}
+
+static inline void put_pixel(unsigned char *out, int bgrx, int r, int g, int b)
+{
+    if (bgrx) {
+        out[0] = b;
+        out[1] = g;
+        out[2] = r;
+        out[3] = 255;
+    } else {
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+    }
+}
+
+static inline void scalar_convert(const color_conv *cc, const unsigned char *in,
+                                  unsigned char *out, int pixels, int bgrx)
+{
+    int bpp = bgrx ? 4 : 3;
+
+    for (int i=0; i<pixels/2; i++) {
+        /* YUYV */
+        int y0 = in[0] - cc->y_off, y1 = in[2] - cc->y_off;
+        int u = in[1] - 128, v = in[3] - 128;
+
+        put_pixel(out, bgrx,
+                  clip((cc->cy * y0 + cc->crv * v + ROUND) >> 16),
+                  clip((cc->cy * y0 - cc->cgu * u - cc->cgv * v + ROUND) >> 16),
+                  clip((cc->cy * y0 + cc->cbu * u + ROUND) >> 16));
+        put_pixel(out + bpp, bgrx,
+                  clip((cc->cy * y1 + cc->crv * v + ROUND) >> 16),
+                  clip((cc->cy * y1 - cc->cgu * u - cc->cgv * v + ROUND) >> 16),
+                  clip((cc->cy * y1 + cc->cbu * u + ROUND) >> 16));
+        in += 4;
+        out += bpp * 2;
+    }
+}
+
+static inline void lut_convert(const color_conv *cc, const unsigned char *in,
+                               unsigned char *out, int pixels, int bgrx)
+{
+    const unsigned char *ct = cc->clip_tab;
+    int bpp = bgrx ? 4 : 3;
+
+    for (int i=0; i<pixels/2; i++) {
+        /* chroma is shared by the pair, look it up once */
+        int rv = cc->rv_tab[in[3]];
+        int guv = cc->gu_tab[in[1]] + cc->gv_tab[in[3]];
+        int bu = cc->bu_tab[in[1]];
+        int y0 = cc->y_tab[in[0]], y1 = cc->y_tab[in[2]];
+
+        put_pixel(out, bgrx, ct[(y0 + rv) >> 16], ct[(y0 - guv) >> 16], ct[(y0 + bu) >> 16]);
+        put_pixel(out + bpp, bgrx, ct[(y1 + rv) >> 16], ct[(y1 - guv) >> 16], ct[(y1 + bu) >> 16]);
+        in += 4;
+        out += bpp * 2;
+    }
+}
+
+#ifdef __SSE2__
+/*
+ * 8 pixels in 16-bit lanes. Inputs are shifted left by 6 and coefficients
+ * carry 13 fractional bits, so mulhi leaves 3 fractional bits in the result.
+ */
+static inline void simd_convert8(const color_conv *cc, __m128i x,
+                                 __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i lo16 = _mm_set1_epi16(0x00ff);
+    const __m128i lo32 = _mm_set1_epi32(0x0000ffff);
+    const __m128i c128 = _mm_set1_epi16(128);
+    __m128i y = _mm_and_si128(x, lo16);
+    __m128i c = _mm_srli_epi16(x, 8);       /* U0 V0 U1 V1 ... */
+    __m128i u = _mm_and_si128(c, lo32);
+    __m128i v = _mm_srli_epi32(c, 16);
+    __m128i yy;
+
+    u = _mm_or_si128(u, _mm_slli_epi32(u, 16)); /* U0 U0 U1 U1 ... */
+    v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+    y = _mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(cc->y_off)), 6);
+    u = _mm_slli_epi16(_mm_sub_epi16(u, c128), 6);
+    v = _mm_slli_epi16(_mm_sub_epi16(v, c128), 6);
+    yy = _mm_add_epi16(_mm_mulhi_epi16(y, _mm_set1_epi16(cc->simd_coef[0])), _mm_set1_epi16(4));
+    *r = _mm_srai_epi16(_mm_add_epi16(yy, _mm_mulhi_epi16(v, _mm_set1_epi16(cc->simd_coef[1]))), 3);
+    *g = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(yy,
+                        _mm_mulhi_epi16(u, _mm_set1_epi16(cc->simd_coef[2]))),
+                        _mm_mulhi_epi16(v, _mm_set1_epi16(cc->simd_coef[3]))), 3);
+    *b = _mm_srai_epi16(_mm_add_epi16(yy, _mm_mulhi_epi16(u, _mm_set1_epi16(cc->simd_coef[4]))), 3);
+}
+
+/* 16 pixels per step, pixels must be a multiple of 16 */
+static void simd_convert(const color_conv *cc, const unsigned char *in,
+                         unsigned char *out, int pixels, int bgrx)
+{
+    const __m128i ff = _mm_set1_epi8(-1);
+    __m128i r0, g0, b0, r1, g1, b1, R, G, B, lo, hi, px[4];
+    unsigned char tmp[64];
+
+    for (int i=0; i<pixels; i+=16) {
+        simd_convert8(cc, _mm_loadu_si128((const __m128i *)in), &r0, &g0, &b0);
+        simd_convert8(cc, _mm_loadu_si128((const __m128i *)(in + 16)), &r1, &g1, &b1);
+        /* packus saturates, that is the clip */
+        R = _mm_packus_epi16(r0, r1);
+        G = _mm_packus_epi16(g0, g1);
+        B = _mm_packus_epi16(b0, b1);
+        if (bgrx) {
+            lo = _mm_unpacklo_epi8(B, G);
+            hi = _mm_unpacklo_epi8(R, ff);
+            px[0] = _mm_unpacklo_epi16(lo, hi);
+            px[1] = _mm_unpackhi_epi16(lo, hi);
+            lo = _mm_unpackhi_epi8(B, G);
+            hi = _mm_unpackhi_epi8(R, ff);
+            px[2] = _mm_unpacklo_epi16(lo, hi);
+            px[3] = _mm_unpackhi_epi16(lo, hi);
+            for (int k=0; k<4; k++)
+                _mm_storeu_si128((__m128i *)(out + 16 * k), px[k]);
+            out += 64;
+        } else {
+            /* SSE2 has no byte shuffle, drop the 4th byte while copying out */
+            lo = _mm_unpacklo_epi8(R, G);
+            hi = _mm_unpacklo_epi8(B, ff);
+            _mm_storeu_si128((__m128i *)tmp, _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i *)(tmp + 16), _mm_unpackhi_epi16(lo, hi));
+            lo = _mm_unpackhi_epi8(R, G);
+            hi = _mm_unpackhi_epi8(B, ff);
+            _mm_storeu_si128((__m128i *)(tmp + 32), _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i *)(tmp + 48), _mm_unpackhi_epi16(lo, hi));
+            for (int k=0; k<16; k++) {
+                out[0] = tmp[k * 4];
+                out[1] = tmp[k * 4 + 1];
+                out[2] = tmp[k * 4 + 2];
+                out += 3;
+            }
+        }
+        in += 32;
+    }
+}
+#endif
+
+int color_parse_matrix(const char *name, enum color_matrix *matrix)
+{
+    if (strcmp(name, "bt601") == 0)
+        *matrix = COLOR_BT601;
+    else if (strcmp(name, "bt709") == 0)
+        *matrix = COLOR_BT709;
+    else
+        return -1;
+    return 0;
+}
+
+void color_conv_init(color_conv *cc, enum color_matrix matrix, enum color_range range)
+{
+    double kr = matrix == COLOR_BT709 ? 0.2126 : 0.299;
+    double kb = matrix == COLOR_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    int full = range == COLOR_RANGE_FULL;
+    double ys = full ? 1.0 : 255.0 / 219.0;
+    double cs = full ? 1.0 : 255.0 / 224.0;
+
+    memset(cc, 0, sizeof(*cc));
+    cc->kernel = color_kernel_available(COLOR_KERNEL_SIMD) ? COLOR_KERNEL_SIMD : COLOR_KERNEL_LUT;
+    cc->y_off = full ? 0 : 16;
+    cc->cy = FIX(ys);
+    cc->crv = FIX(2.0 * (1.0 - kr) * cs);
+    cc->cgu = FIX(2.0 * kb * (1.0 - kb) / kg * cs);
+    cc->cgv = FIX(2.0 * kr * (1.0 - kr) / kg * cs);
+    cc->cbu = FIX(2.0 * (1.0 - kb) * cs);
+    for (int i=0; i<256; i++) {
+        /* fold rounding and the clip table offset into the luma table */
+        cc->y_tab[i] = cc->cy * (i - cc->y_off) + ROUND + (CLIP_OFFSET << 16);
+        cc->rv_tab[i] = cc->crv * (i - 128);
+        cc->gu_tab[i] = cc->cgu * (i - 128);
+        cc->gv_tab[i] = cc->cgv * (i - 128);
+        cc->bu_tab[i] = cc->cbu * (i - 128);
+    }
+    cc->simd_coef[0] = (cc->cy + 4) >> 3;
+    cc->simd_coef[1] = (cc->crv + 4) >> 3;
+    cc->simd_coef[2] = (cc->cgu + 4) >> 3;
+    cc->simd_coef[3] = (cc->cgv + 4) >> 3;
+    cc->simd_coef[4] = (cc->cbu + 4) >> 3;
+    for (int i=0; i<(int)sizeof(cc->clip_tab); i++)
+        cc->clip_tab[i] = clip(i - CLIP_OFFSET);
+}
+
+int color_kernel_available(enum color_kernel kernel)
+{
+#ifdef __SSE2__
+    return 1;
+#else
+    return kernel != COLOR_KERNEL_SIMD;
+#endif
+}
+
+void color_yuyv_to_rgb24(const color_conv *cc, const unsigned char *in, unsigned char *out, int pixels)
+{
+    switch (cc->kernel) {
+        case COLOR_KERNEL_SCALAR:
+            scalar_convert(cc, in, out, pixels, 0);
+            break;
+        case COLOR_KERNEL_SIMD:
+#ifdef __SSE2__
+            simd_convert(cc, in, out, pixels & ~15, 0);
+            in += (pixels & ~15) * 2;
+            out += (pixels & ~15) * 3;
+            pixels &= 15;
+#endif
+            /* tail goes through the tables */
+        case COLOR_KERNEL_LUT:
+        default:
+            lut_convert(cc, in, out, pixels, 0);
+            break;
+    }
+}
+
+void color_yuyv_to_bgrx(const color_conv *cc, const unsigned char *in, unsigned char *out, int pixels)
+{
+    switch (cc->kernel) {
+        case COLOR_KERNEL_SCALAR:
+            scalar_convert(cc, in, out, pixels, 1);
+            break;
+        case COLOR_KERNEL_SIMD:
+#ifdef __SSE2__
+            simd_convert(cc, in, out, pixels & ~15, 1);
+            in += (pixels & ~15) * 2;
+            out += (pixels & ~15) * 4;
+            pixels &= 15;
+#endif
+            /* tail goes through the tables */
+        case COLOR_KERNEL_LUT:
+        default:
+            lut_convert(cc, in, out, pixels, 1);
+            break;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+/*
+ * YUYV to RGB conversion shared by the snapshots and the framebuffer.
+ * All kernels are fixed point, pixels must be even (one U/V per pair).
+ */
+
+enum color_matrix {
+    COLOR_BT601,
+    COLOR_BT709,
+};
+
+enum color_range {
+    COLOR_RANGE_LIMITED, /* Y 16..235, UV 16..240 */
+    COLOR_RANGE_FULL,    /* Y 0..255, UV 0..255 */
+};
+
+enum color_kernel {
+    COLOR_KERNEL_SCALAR, /* straight multiplies, reference */
+    COLOR_KERNEL_LUT,    /* per channel tables, no multiplies */
+    COLOR_KERNEL_SIMD,   /* SSE2, 16 pixels per step, LUT for the tail */
+};
+
+typedef struct color_conv {
+    enum color_kernel kernel;
+    /* coefficients with 16 fractional bits */
+    int y_off;
+    int cy, crv, cgu, cgv, cbu;
+    /* LUT kernel, already scaled and rounded */
+    int y_tab[256];
+    int rv_tab[256];
+    int gu_tab[256];
+    int gv_tab[256];
+    int bu_tab[256];
+    unsigned char clip_tab[1024];
+    /* SIMD kernel, coefficients with 13 fractional bits */
+    short simd_coef[5];
+} color_conv;
+
+/* "bt601" or "bt709", for command lines, return 0 success, return -1 unknown */
+int color_parse_matrix(const char *name, enum color_matrix *matrix);
+/* picks the fastest kernel available */
+void color_conv_init(color_conv *cc, enum color_matrix matrix, enum color_range range);
+/* return 1 when the kernel is built in, SIMD falls back to LUT otherwise */
+int color_kernel_available(enum color_kernel kernel);
+/* 3 bytes per pixel, R G B, as in PPM */
+void color_yuyv_to_rgb24(const color_conv *cc, const unsigned char *in, unsigned char *out, int pixels);
+/* 4 bytes per pixel, B G R 255, as in a 32bpp framebuffer */
+void color_yuyv_to_bgrx(const color_conv *cc, const unsigned char *in, unsigned char *out, int pixels);
+
+#endif
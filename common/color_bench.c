@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "color.h"
+
+/* compares the conversion kernels by pixels per second on a 1080p frame */
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define MIN_SECONDS 1.0
+
+static double now(void);
+static double bench(const color_conv *cc, int bgrx, const unsigned char *in, unsigned char *out);
+static int max_diff(const unsigned char *a, const unsigned char *b, size_t size);
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* return Mpixel per second */
+static double bench(const color_conv *cc, int bgrx, const unsigned char *in, unsigned char *out)
+{
+    double start = now(), elapsed;
+    long frames = 0;
+
+    do {
+        if (bgrx)
+            color_yuyv_to_bgrx(cc, in, out, WIDTH * HEIGHT);
+        else
+            color_yuyv_to_rgb24(cc, in, out, WIDTH * HEIGHT);
+        frames++;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+    return (double)frames * WIDTH * HEIGHT / elapsed / 1e6;
+}
+
+static int max_diff(const unsigned char *a, const unsigned char *b, size_t size)
+{
+    int diff = 0;
+
+    for (size_t i=0; i<size; i++) {
+        int d = abs(a[i] - b[i]);
+        if (d > diff)
+            diff = d;
+    }
+    return diff;
+}
+
+int main(void)
+{
+    const char *kernel_name[] = { "scalar", "lut", "simd" };
+    const char *matrix_name[] = { "BT.601", "BT.709" };
+    const char *range_name[] = { "limited", "full" };
+    size_t out_size = (size_t)WIDTH * HEIGHT * 4;
+    unsigned char *in = malloc((size_t)WIDTH * HEIGHT * 2);
+    unsigned char *ref = malloc(out_size);
+    unsigned char *out = malloc(out_size);
+    color_conv cc;
+
+    if (!in || !ref || !out) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (size_t i=0; i<(size_t)WIDTH * HEIGHT * 2; i++)
+        in[i] = rand() & 0xff;
+
+    for (int m=COLOR_BT601; m<=COLOR_BT709; m++) {
+        for (int r=COLOR_RANGE_LIMITED; r<=COLOR_RANGE_FULL; r++) {
+            color_conv_init(&cc, m, r);
+            printf("%s %s range, %dx%d\n", matrix_name[m], range_name[r], WIDTH, HEIGHT);
+            for (int bgrx=0; bgrx<2; bgrx++) {
+                for (int k=COLOR_KERNEL_SCALAR; k<=COLOR_KERNEL_SIMD; k++) {
+                    if (!color_kernel_available(k))
+                        continue;
+                    cc.kernel = k;
+                    double mpps = bench(&cc, bgrx, in, k == COLOR_KERNEL_SCALAR ? ref : out);
+                    printf("  %-6s %-5s %8.1f Mpixel/s", kernel_name[k], bgrx ? "bgrx" : "rgb24", mpps);
+                    if (k != COLOR_KERNEL_SCALAR)
+                        printf("  max diff vs scalar %d",
+                               max_diff(ref, out, (size_t)WIDTH * HEIGHT * (bgrx ? 4 : 3)));
+                    printf("\n");
+                }
+            }
+        }
+    }
+    free(in);
+    free(ref);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* every TCP frame starts with this header, magic lets the receiver resync */
+#define FRAME_MAGIC 0x4c4e5846
+#define FRAME_MAX_WIDTH 4096
+#define FRAME_MAX_HEIGHT 4096
+
+/* has padding after magic, zero the whole struct before filling it */
+typedef struct HEADER {
+    uint32_t magic;
+    struct timeval time;
+    int width;
+    int height;
+} Header;
+
+/*
+ * the geometry every transport accepts, YUYV needs an even width; within
+ * these bounds width * height * 2 always fits in an int
+ */
+static inline int frame_size_valid(int width, int height)
+{
+    return width > 0 && width <= FRAME_MAX_WIDTH && !(width & 1)
+        && height > 0 && height <= FRAME_MAX_HEIGHT;
+}
+
+#endif
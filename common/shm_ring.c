@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "frame.h"
+#include "shm_ring.h"
+
+#define CLEAR(x) (memset(&(x), 0, sizeof(x)))
+#define RING_MAGIC 0x4c534852
+#define CACHE_LINE 64
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/*
+ * Placed at the start of the memfd. head is only written by the producer and
+ * tail only by the consumer, keep them on their own cache lines. Both count
+ * up forever, slot_num is a power of two so wrap around stays correct.
+ */
+typedef struct ring_ctrl {
+    uint32_t magic;
+    uint32_t slot_num;
+    uint64_t slot_stride;
+    uint32_t head __attribute__((aligned(CACHE_LINE)));
+    uint32_t tail __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE))) ring_ctrl;
+
+static socklen_t ring_addr(struct sockaddr_un *addr);
+static int send_fds(int sockfd, int memfd, int evfd);
+static int recv_fds(int sockfd, int *memfd, int *evfd);
+static inline shm_slot *ring_slot(shm_ring *ring, uint32_t index);
+
+static socklen_t ring_addr(struct sockaddr_un *addr)
+{
+    CLEAR(*addr);
+    addr->sun_family = AF_UNIX;
+    /* abstract namespace, nothing to unlink when the receiver dies */
+    strncpy(addr->sun_path + 1, SHM_RING_SOCKET, sizeof(addr->sun_path) - 2);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(SHM_RING_SOCKET);
+}
+
+static int send_fds(int sockfd, int memfd, int evfd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char dummy = 0;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } u;
+
+    CLEAR(msg);
+    CLEAR(u);
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    memcpy(CMSG_DATA(cmsg) + sizeof(int), &evfd, sizeof(int));
+    if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+/* return 0 success, return 1 nothing yet, return -1 fail */
+static int recv_fds(int sockfd, int *memfd, int *evfd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char dummy;
+    ssize_t len;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } u;
+
+    CLEAR(msg);
+    CLEAR(u);
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    if ((len = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 1;
+        perror("recvmsg");
+        return -1;
+    }
+    if (len == 0)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+              || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+        /* do not leak whatever fds did arrive */
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), fd;
+            for (int i=0; i<n; i++) {
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                close(fd);
+            }
+        }
+        fprintf(stderr, "shm ring: peer did not pass memfd and eventfd\n");
+        return -1;
+    }
+    memcpy(memfd, CMSG_DATA(cmsg), sizeof(int));
+    memcpy(evfd, CMSG_DATA(cmsg) + sizeof(int), sizeof(int));
+    return 0;
+}
+
+static inline shm_slot *ring_slot(shm_ring *ring, uint32_t index)
+{
+    size_t offset = sizeof(ring_ctrl) + (index & (ring->slot_num - 1)) * ring->slot_stride;
+    return (shm_slot *)((char *)ring->base + offset);
+}
+
+int shm_ring_connect(shm_ring *ring, int slot_num, size_t frame_size)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen = ring_addr(&addr);
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    ring_ctrl *ctrl;
+    uint32_t num = 1;
+    size_t stride;
+
+    ring->base = MAP_FAILED;
+    ring->memfd = ring->eventfd = -1;
+    /* non blocking: this runs on the capture thread */
+    if ((ring->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    /* no local receiver is not an error, the caller falls back to TCP */
+    if (connect(ring->sockfd, (struct sockaddr *)&addr, addrlen) == -1)
+        goto fail;
+    /* anyone can bind the abstract name first, only hand frames to root or our own user */
+    if (getsockopt(ring->sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror("SO_PEERCRED");
+        goto fail;
+    }
+    if (cred.uid != 0 && cred.uid != geteuid()) {
+        fprintf(stderr, "shm ring: refuse receiver of uid %d\n", (int)cred.uid);
+        goto fail;
+    }
+    while (num < slot_num)
+        num <<= 1;
+    stride = ALIGN_UP(sizeof(shm_slot) + frame_size, CACHE_LINE);
+    ring->map_size = sizeof(ring_ctrl) + num * stride;
+    if ((ring->memfd = memfd_create("linuxls-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+        perror("memfd_create");
+        goto fail;
+    }
+    if (ftruncate(ring->memfd, ring->map_size) == -1) {
+        perror("ftruncate");
+        goto fail;
+    }
+    /* the receiver maps the whole file, never let it shrink under it */
+    if (fcntl(ring->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+        perror("F_ADD_SEALS");
+    ring->base = mmap(NULL, ring->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (ring->base == MAP_FAILED) {
+        perror("mmap ring");
+        goto fail;
+    }
+    ring->slot_num = num;
+    ring->slot_stride = stride;
+    ctrl = (ring_ctrl *)ring->base;
+    ctrl->slot_num = num;
+    ctrl->slot_stride = stride;
+    ctrl->head = 0;
+    ctrl->tail = 0;
+    ctrl->magic = RING_MAGIC;
+    if ((ring->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+        perror("eventfd");
+        goto fail;
+    }
+    if (send_fds(ring->sockfd, ring->memfd, ring->eventfd) == -1)
+        goto fail;
+    return 0;
+fail:
+    shm_ring_close(ring);
+    return -1;
+}
+
+int shm_ring_acked(shm_ring *ring)
+{
+    char ack;
+    ssize_t r = recv(ring->sockfd, &ack, 1, MSG_DONTWAIT);
+
+    if (r == 1)
+        return 1;
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    return -1;
+}
+
+int shm_ring_peer_closed(shm_ring *ring)
+{
+    char buf[16];
+    ssize_t r;
+
+    /* the receiver only ever sends the ack byte, eat it so EOF shows up */
+    while ((r = recv(ring->sockfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        ;
+    if (r == 0)
+        return 1;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return 1;
+    return 0;
+}
+
+shm_slot *shm_ring_get_write_slot(shm_ring *ring)
+{
+    ring_ctrl *ctrl = (ring_ctrl *)ring->base;
+    uint32_t head = ctrl->head;
+    uint32_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= ring->slot_num)
+        return NULL;
+    return ring_slot(ring, head);
+}
+
+void shm_ring_publish(shm_ring *ring)
+{
+    ring_ctrl *ctrl = (ring_ctrl *)ring->base;
+    uint64_t one = 1;
+
+    __atomic_store_n(&ctrl->head, ctrl->head + 1, __ATOMIC_RELEASE);
+    /* only fails with EAGAIN when the counter is saturated, reader is awake anyway */
+    if (write(ring->eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("write eventfd");
+}
+
+int shm_ring_listen(void)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen = ring_addr(&addr);
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+        perror("bind shm ring socket");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 4) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shm_ring_accept(int listenfd, shm_ring *ring)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    ring->base = MAP_FAILED;
+    ring->memfd = ring->eventfd = -1;
+    /* non blocking: a peer that never sends its fds must not stall epoll */
+    if ((ring->sockfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
+        return -1;
+    }
+    /* abstract sockets have no permissions, only root or our own user */
+    if (getsockopt(ring->sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror("SO_PEERCRED");
+        goto fail;
+    }
+    if (cred.uid != 0 && cred.uid != geteuid()) {
+        fprintf(stderr, "shm ring: refuse sender of uid %d\n", (int)cred.uid);
+        goto fail;
+    }
+    return 0;
+fail:
+    shm_ring_close(ring);
+    return 1;
+}
+
+int shm_ring_attach(shm_ring *ring)
+{
+    struct stat st;
+    ring_ctrl *ctrl;
+    uint32_t slot_num;
+    uint64_t slot_stride;
+    int seals, r;
+    char ack = 1;
+
+    if ((r = recv_fds(ring->sockfd, &ring->memfd, &ring->eventfd)) != 0)
+        return r == 1 ? 1 : -1;
+    /* without the shrink seal the sender could truncate it and SIGBUS us */
+    if ((seals = fcntl(ring->memfd, F_GET_SEALS)) == -1 || !(seals & F_SEAL_SHRINK)) {
+        fprintf(stderr, "shm ring: memfd is not sealed against shrinking\n");
+        return -1;
+    }
+    if (fstat(ring->memfd, &st) == -1 || st.st_size < sizeof(ring_ctrl)) {
+        fprintf(stderr, "shm ring: bad memfd\n");
+        return -1;
+    }
+    ring->map_size = st.st_size;
+    ring->base = mmap(NULL, ring->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (ring->base == MAP_FAILED) {
+        perror("mmap ring");
+        return -1;
+    }
+    ctrl = (ring_ctrl *)ring->base;
+    /* read the layout once, the sender can still write the shared copy */
+    slot_num = ctrl->slot_num;
+    slot_stride = ctrl->slot_stride;
+    if (ctrl->magic != RING_MAGIC || slot_num == 0
+            || (slot_num & (slot_num - 1))
+            || slot_stride <= sizeof(shm_slot)
+            || slot_stride > (ring->map_size - sizeof(ring_ctrl)) / slot_num
+            || sizeof(ring_ctrl) + slot_num * slot_stride > ring->map_size) {
+        fprintf(stderr, "shm ring: bad ring layout\n");
+        return -1;
+    }
+    ring->slot_num = slot_num;
+    ring->slot_stride = slot_stride;
+    if (send(ring->sockfd, &ack, 1, MSG_DONTWAIT | MSG_NOSIGNAL) != 1) {
+        perror("shm ring ack");
+        return -1;
+    }
+    return 0;
+}
+
+const unsigned char *shm_ring_get_read_slot(shm_ring *ring, shm_slot *info)
+{
+    ring_ctrl *ctrl = (ring_ctrl *)ring->base;
+    shm_slot *slot;
+
+    while (ctrl->tail != __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE)) {
+        slot = ring_slot(ring, ctrl->tail);
+        memcpy(info, slot, sizeof(*info));
+        /* same frames as over TCP, and never past the end of the slot */
+        if (frame_size_valid(info->width, info->height)
+                && info->length <= ring->slot_stride - sizeof(shm_slot)
+                && (size_t)info->width * info->height * 2 <= info->length)
+            return slot->data;
+        /* corrupted slot, skip it rather than read past it */
+        shm_ring_release(ring);
+    }
+    return NULL;
+}
+
+void shm_ring_release(shm_ring *ring)
+{
+    ring_ctrl *ctrl = (ring_ctrl *)ring->base;
+
+    __atomic_store_n(&ctrl->tail, ctrl->tail + 1, __ATOMIC_RELEASE);
+}
+
+void shm_ring_close(shm_ring *ring)
+{
+    if (ring->base != MAP_FAILED && ring->base != NULL)
+        munmap(ring->base, ring->map_size);
+    if (ring->memfd != -1)
+        close(ring->memfd);
+    if (ring->eventfd != -1)
+        close(ring->eventfd);
+    if (ring->sockfd != -1)
+        close(ring->sockfd);
+    ring->base = MAP_FAILED;
+    ring->memfd = ring->eventfd = ring->sockfd = -1;
+}
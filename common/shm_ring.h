@@ -0,0 +1,67 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/*
+ * Local transport: a single-producer single-consumer ring of frame slots
+ * living in a memfd. The sender creates the ring and passes the memfd and
+ * an eventfd to the receiver over an abstract unix socket, after that every
+ * frame only costs one copy into the slot and one eventfd write.
+ * Both ends only talk to root or their own user, and the receiver answers
+ * one ack byte once the ring is attached.
+ */
+
+#define SHM_RING_SOCKET "linuxls-shm"
+
+typedef struct shm_slot {
+    struct timeval time;
+    int width;
+    int height;
+    size_t length;
+    unsigned char data[];
+} shm_slot;
+
+typedef struct shm_ring {
+    void *base;
+    size_t map_size;
+    /* layout checked once at attach, never read back from shared memory */
+    uint32_t slot_num;
+    size_t slot_stride;
+    int memfd;
+    int eventfd;
+    int sockfd; /* control connection, hangs up when the peer goes away */
+} shm_ring;
+
+/* sender side: return 0 success, return -1 fail (no trusted local receiver) */
+int shm_ring_connect(shm_ring *ring, int slot_num, size_t frame_size);
+/* poll for the receiver's ack, return 1 attached, return 0 not yet, return -1 refused */
+int shm_ring_acked(shm_ring *ring);
+/* return 1 when the receiver has closed its end */
+int shm_ring_peer_closed(shm_ring *ring);
+/* return NULL when the ring is full, the caller should drop the frame */
+shm_slot *shm_ring_get_write_slot(shm_ring *ring);
+void shm_ring_publish(shm_ring *ring);
+
+/* receiver side: return listen fd */
+int shm_ring_listen(void);
+/*
+ * return 0 accepted, only ring->sockfd is valid until attached,
+ * return 1 peer refused (keep accepting), return -1 nothing left to accept
+ */
+int shm_ring_accept(int listenfd, shm_ring *ring);
+/* take the memfd and eventfd, return 0 attached, return 1 not arrived yet, return -1 fail */
+int shm_ring_attach(shm_ring *ring);
+/*
+ * return the frame data, NULL when the ring is empty. info gets a private
+ * copy of the slot header, use it instead of the shared one. Slots failing
+ * frame_size_valid are skipped, like bad headers on TCP.
+ */
+const unsigned char *shm_ring_get_read_slot(shm_ring *ring, shm_slot *info);
+void shm_ring_release(shm_ring *ring);
+
+void shm_ring_close(shm_ring *ring);
+
+#endif
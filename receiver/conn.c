@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "conn.h"
+#include "fb_video.h"
+
+static void conn_resync(conn *c);
+static void conn_start_pic(conn *c);
+static int conn_recv_header(conn *c);
+static int conn_recv_pic(conn *c, char *fb_start);
+
+static conn *conns[CONN_MAX_FD];
+
+conn *conn_new(int fd)
+{
+    conn *c;
+
+    if (fd >= CONN_MAX_FD) {
+        fprintf(stderr, "too many connections, drop fd %d\n", fd);
+        return NULL;
+    }
+    /*
+     * fd number reused before we saw the hangup: the old socket is already
+     * closed and fd is the new one, only drop the stale state
+     */
+    if (conns[fd]) {
+        free(conns[fd]);
+        conns[fd] = NULL;
+    }
+    if ((c = (conn *)calloc(1, sizeof(conn))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    c->fd = fd;
+    conns[fd] = c;
+    return c;
+}
+
+conn *conn_get(int fd)
+{
+    if (fd < 0 || fd >= CONN_MAX_FD)
+        return NULL;
+    return conns[fd];
+}
+
+void conn_close(int epfd, conn *c)
+{
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL) == -1)
+        perror("epoll_ctl del");
+    if (close(c->fd) == -1)
+        perror("close connection");
+    conns[c->fd] = NULL;
+    free(c);
+}
+
+/* drop bytes until the gathered header starts with (a prefix of) the magic */
+static void conn_resync(conn *c)
+{
+    const uint32_t magic = FRAME_MAGIC;
+    char *hdr = (char *)&c->header;
+    size_t i;
+
+    for (i = 1; i < c->header_len; i++) {
+        size_t n = c->header_len - i < sizeof(magic) ? c->header_len - i : sizeof(magic);
+        if (memcmp(hdr + i, &magic, n) == 0)
+            break;
+    }
+    memmove(hdr, hdr + i, c->header_len - i);
+    c->header_len -= i;
+}
+
+static void conn_start_pic(conn *c)
+{
+    struct timeval timenow;
+
+    gettimeofday(&timenow, NULL);
+    c->getheader = 1;
+    c->pic_size = c->header.width * c->header.height * 2;
+    c->pic_offset = 0;
+    c->remainder = 0;
+    /* still drain old frames, just do not spend time drawing them */
+    c->stale = timenow.tv_sec - c->header.time.tv_sec >= 3;
+}
+
+/* return 1 header complete, 0 need more data, -1 connection done */
+static int conn_recv_header(conn *c)
+{
+    int len;
+
+    while (1) {
+        while (c->header_len < sizeof(Header)) {
+            len = recv(c->fd, (char *)&c->header + c->header_len,
+                       sizeof(Header) - c->header_len, 0);
+            if (len == -1 && errno == EINTR)
+                continue;
+            if (len == 0)
+                return -1;
+            if (len == -1)
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            c->header_len += len;
+            if (c->header_len >= sizeof(uint32_t) && c->header.magic != FRAME_MAGIC)
+                conn_resync(c);
+        }
+        if (frame_size_valid(c->header.width, c->header.height))
+            break;
+        fprintf(stderr, "bad frame header on fd %d, resync\n", c->fd);
+        conn_resync(c);
+    }
+    c->header_len = 0;
+    conn_start_pic(c);
+    return 1;
+}
+
+/* return 1 picture complete, 0 need more data, -1 connection done */
+static int conn_recv_pic(conn *c, char *fb_start)
+{
+    int len, total, show;
+    int width = c->header.width, height = c->header.height;
+
+    while (c->pic_size > 0) {
+        len = recv(c->fd, c->buf + c->remainder,
+                   c->pic_size < CONN_BUF_SIZE ? c->pic_size : CONN_BUF_SIZE, 0);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == 0)
+            return -1;
+        if (len == -1)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        c->pic_size -= len;
+        total = c->remainder + len;
+        show = total & ~3;
+        if (!c->stale && show)
+            fb_display_pic((void *)c->buf, fb_start, width, height, 300, 0, c->pic_offset, show);
+        c->pic_offset += show;
+        c->remainder = total - show;
+        memmove(c->buf, c->buf + show, c->remainder);
+    }
+    c->getheader = 0;
+    return 1;
+}
+
+int conn_recv(conn *c, char *fb_start)
+{
+    int frames = 0, r;
+
+    /* edge triggered: keep reading until the socket is drained */
+    while (1) {
+        r = c->getheader ? conn_recv_pic(c, fb_start) : conn_recv_header(c);
+        if (r == -1)
+            return -1;
+        if (r == 0)
+            break;
+        if (!c->getheader)
+            frames++;
+    }
+    return frames;
+}
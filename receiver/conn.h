@@ -0,0 +1,33 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stddef.h>
+
+#include "frame.h"
+
+/* per sender connection state, one stream never leaks into another */
+
+#define CONN_BUF_SIZE 60000
+#define CONN_MAX_FD 1024
+
+typedef struct conn {
+    int fd;
+    int getheader;
+    Header header;
+    size_t header_len;  /* header bytes gathered so far */
+    int pic_size;       /* picture bytes still to receive */
+    int pic_offset;     /* picture bytes already displayed */
+    int remainder;      /* bytes kept back, display needs multiple of 4 */
+    int stale;
+    char buf[CONN_BUF_SIZE + 3];
+} conn;
+
+/* return NULL fail */
+conn *conn_new(int fd);
+/* return NULL if fd is not a sender connection */
+conn *conn_get(int fd);
+/* return frames completed, return -1 when the connection must be closed */
+int conn_recv(conn *c, char *fb_start);
+void conn_close(int epfd, conn *c);
+
+#endif
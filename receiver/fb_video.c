@@ -7,42 +7,16 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
+#include "color.h"
 #include "fb_video.h"
 
 #define CLEAR(x) (memset(&(x), 0, sizeof(x)))
 
-typedef struct RGB {
-    int r;
-    int g;
-    int b;
-} RGB;
-
-static inline int clip(int value, int min, int max);
 static inline int xioctl(int fd, int request, void *arg);
-static inline RGB YUV_to_RGB(int y, int u, int v);
 
 static struct fb_fix_screeninfo finfo = {0};
 static struct fb_var_screeninfo vinfo = {0};
-
-static inline int clip(int value, int min, int max)
-{
-    return (value > max ? max : (value < min ? min : value));
-}
-
-static inline RGB YUV_to_RGB(int y, int u, int v)
-{
-    RGB rgb;
-    int r,g,b;
-    u = u -128;
-    v = v-128;
-    r = (298 * y + 409 * v + 128) >> 8;
-    g = (298 * y - 100 * u - 208 * v + 128) >> 8;
-    b = (298 * y + 516 * u + 128) >> 8;
-    rgb.r = clip(r, 0, 255);
-    rgb.b = clip(b, 0, 255);
-    rgb.g = clip(g, 0, 255);
-    return rgb;
-}
+static color_conv cc;
 
 static inline int xioctl(int fd, int request, void *arg)
 {
@@ -75,6 +49,8 @@ char* fb_init(int fbfd)
         return NULL;
     }
     printf("line_length: %d\n", finfo.line_length);
+    /* webcams send BT.601 limited range unless told otherwise */
+    color_conv_init(&cc, COLOR_BT601, COLOR_RANGE_LIMITED);
     /* Get variable screen information */
     if (xioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo) == -1) {
         perror("FBIOGET_VSCREENINFO");
@@ -88,47 +64,40 @@ char* fb_init(int fbfd)
     return fb_start;
 }
 
+void fb_set_colorspace(enum color_matrix matrix, enum color_range range)
+{
+    color_conv_init(&cc, matrix, range);
+}
+
 void fb_display_pic(void *pic, char *fb_start, int width, int height,
                     int x_offset, int y_offset, int start_byte, int pic_len)
 {
-    if (!pic_len)
-        return;
-    unsigned char* in = (unsigned char*)pic;
-    int y0,y1,u,v;
-    RGB rgb;
-    long location=0;
-    int i = 0;
-    int y, x;
-    for (y=(start_byte/(width*2)); y<height; y++) {
-        if (i == 0)
-            x = (start_byte/2)%width;
-        else
-            x = 0;
-        for(; x<width; x+=2) {
+    unsigned char *in = (unsigned char *)pic;
+    int pos = start_byte, end = start_byte + pic_len;
+    int x, y, pixels, visible;
+    long location;
+
+    /* convert row by row, pic may start and end in the middle of a row */
+    while (pos < end) {
+        y = pos / (width * 2);
+        x = (pos / 2) % width;
+        if (y >= height)
+            return;
+        pixels = width - x;
+        if (pixels > (end - pos) / 2)
+            pixels = (end - pos) / 2;
+        /* never write past the visible screen */
+        visible = (int)vinfo.xres - (x + x_offset);
+        if (visible > pixels)
+            visible = pixels;
+        if (y + y_offset < (int)vinfo.yres && visible > 0) {
             location = (x+x_offset+vinfo.xoffset) * 4 +
                        (y+y_offset+vinfo.yoffset) * finfo.line_length;
-            y0 = in[i];
-            y1 = in[i+2];
-            u = in[i+1];
-            v = in[i+3];
-
-            rgb = YUV_to_RGB(y0, u, v);
-            fb_start[location+0] = clip(rgb.b, 0, 255);
-            fb_start[location+1] = clip(rgb.g, 0, 255);
-            fb_start[location+2] = clip(rgb.r, 0, 255);
-            fb_start[location+3] = 255;
-
-            rgb = YUV_to_RGB(y1, u, v);
-            fb_start[location+4] = clip(rgb.b, 0, 255);
-            fb_start[location+5] = clip(rgb.g, 0, 255);
-            fb_start[location+6] = clip(rgb.r, 0, 255);
-            fb_start[location+7] = 255;
-            i += 4;
-            if (i == pic_len)
-                return ;
+            color_yuyv_to_bgrx(&cc, in, (unsigned char *)fb_start + location, visible & ~1);
         }
+        in += pixels * 2;
+        pos += pixels * 2;
     }
-    return ;
 }
 
 int fb_munmap_buf(char *fb_start)
@@ -1,12 +1,16 @@
 #ifndef FB_VIDEO_H
 #define FB_VIDEO_H
 
+#include "color.h"
+
 /* fb means framebuffer, we play the video through this dev */
 
 /* return open fd */
 int fb_open(char *dev_name);
 /* return start pointer we map */
 char *fb_init(int fbfd);
+/* fb_init defaults to BT.601 limited range, call after it to change that */
+void fb_set_colorspace(enum color_matrix matrix, enum color_range range);
 void fb_display_pic(void *pic, char *fb_start, int width, int height,
                     int x_offset, int y_offset, int start_byte, int pic_len);
 int fb_munmap_buf(char *fb_start);
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +10,10 @@
 #include <sys/epoll.h>
 #include <sys/time.h>
 
+#include "conn.h"
 #include "fb_video.h"
+#include "frame.h"
+#include "shm_ring.h"
 
 #define CLEAR(x) (memset(&(x), 0, sizeof(x)))
 #define EXEC_CMD_AND_CHECK(cmd, return_value, message) do { \
@@ -20,14 +24,16 @@
                                 printf(#message" exec.\n"); \
                             } while (0);
 
-typedef struct HEADER {
-    struct timeval time;
-    int width;
-    int height;
-} Header;
+/* one ring per local sender, like one TCP connection per remote one */
+#define SHM_MAX_RINGS 16
+
+static shm_ring rings[SHM_MAX_RINGS];
 
 static inline void calculate_fps();
 void epoll_addfd(int epoll, int fd, int in);
+static void shm_display_frames(shm_ring *ring, char *fb_start);
+static void shm_try_attach(int epfd, shm_ring *ring, char *fb_start);
+static shm_ring *shm_find(int fd);
 
 static inline void calculate_fps() {
     static int num = 0;
@@ -66,16 +72,56 @@ void epoll_addfd(int epfd, int fd, int in)
         perror("fcntl");
 }
 
-int main(void)
+static void shm_display_frames(shm_ring *ring, char *fb_start)
+{
+    const unsigned char *data;
+    shm_slot info;
+    uint64_t count;
+
+    /* edge triggered: clear the counter first, then drain every ready slot */
+    if (read(ring->eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        perror("read eventfd");
+    while ((data = shm_ring_get_read_slot(ring, &info)) != NULL) {
+        fb_display_pic((void *)data, fb_start, info.width, info.height,
+                       300, 0, 0, info.width * info.height * 2);
+        shm_ring_release(ring);
+        calculate_fps();
+    }
+}
+
+/* the fds may still be on their way, then wait for the next EPOLLIN */
+static void shm_try_attach(int epfd, shm_ring *ring, char *fb_start)
+{
+    int r = shm_ring_attach(ring);
+
+    if (r == 1)
+        return;
+    if (r == -1) {
+        /* closing the fds also drops them from the epoll set */
+        shm_ring_close(ring);
+        return;
+    }
+    epoll_addfd(epfd, ring->eventfd, 1);
+    shm_display_frames(ring, fb_start);
+}
+
+/* return the ring owning fd, fd == -1 returns a free entry, NULL if none */
+static shm_ring *shm_find(int fd)
 {
-    int fbfd = -1, server_fd = -1, len = 0, flag;
+    for (int i=0; i<SHM_MAX_RINGS; i++) {
+        if (fd == -1 ? rings[i].sockfd == -1
+                     : (rings[i].sockfd == fd || rings[i].eventfd == fd))
+            return &rings[i];
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int fbfd = -1, server_fd = -1, flag;
     char *fb_start = NULL;
     struct sockaddr_in myaddr, clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
-    int buf_size = 60000;
-    char buf[60003] = {0};
-    char* buf_start = buf + 3; // 3 bit to keep last recv data not multiple of 4
-    int remainder = 0, pic_size = 0;
     int epfd;
     struct epoll_event event;
     struct epoll_event *events;
@@ -84,12 +130,35 @@ int main(void)
     int nfds; // record epoll_wait return value
     int tmpfd; // record epoll_event.data.fd
     int cfd; // record accept return value
-    int getheader = 0;
-    Header header;
-    struct timeval timenow;
+    int frames;
+    conn *c;
+    int shm_listen_fd = -1;
+    shm_ring newring, *ring;
+    int r, opt;
+    enum color_matrix matrix = COLOR_BT601;
+    enum color_range range = COLOR_RANGE_LIMITED;
+
+    /* -m bt601|bt709, -f: full range, must match what the camera sends */
+    while ((opt = getopt(argc, argv, "m:f")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (color_parse_matrix(optarg, &matrix) == -1) {
+                    fprintf(stderr, "unknown color matrix %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                range = COLOR_RANGE_FULL;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-m bt601|bt709] [-f]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
 
     EXEC_CMD_AND_CHECK(fbfd = fb_open("/dev/fb0"), -1, fb_open);
     EXEC_CMD_AND_CHECK(fb_start = fb_init(fbfd), NULL, fb_init);
+    fb_set_colorspace(matrix, range);
 
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror ("socket failed!");
@@ -118,6 +187,13 @@ int main(void)
         exit(EXIT_FAILURE);
     }
     epoll_addfd(epfd, server_fd, 1);
+    /* local senders pass frames through a shared memory ring instead */
+    for (int i=0; i<SHM_MAX_RINGS; i++) {
+        rings[i].base = NULL;
+        rings[i].memfd = rings[i].eventfd = rings[i].sockfd = -1;
+    }
+    if ((shm_listen_fd = shm_ring_listen()) != -1)
+        epoll_addfd(epfd, shm_listen_fd, 1);
     evsize = 64;
     events = (struct epoll_event *)malloc(sizeof(struct epoll_event)*evsize);
     epoll_timeout = 2;
@@ -128,6 +204,10 @@ int main(void)
             tmpfd = event.data.fd;
             if (tmpfd == server_fd) {
                 while ((cfd = accept(tmpfd, (struct sockaddr*)&clientaddr, &clientlen)) > 0) {
+                    if (conn_new(cfd) == NULL) {
+                        close(cfd);
+                        continue;
+                    }
                     epoll_addfd(epfd, cfd, 1);
                 }
                 if (cfd == -1) {
@@ -135,53 +215,42 @@ int main(void)
                         perror("accept");
                 }
             }
-            else if (event.events & EPOLLIN) {
-                while ((len = recv(tmpfd, buf_start, buf_size, 0)) > 0) {
-                    if (!getheader) {
-                        memcpy(&header, buf_start, sizeof(header));
-                        getheader = 1;
-                        pic_size = header.width * header.height * 2;
-                        pic_size += sizeof(header);
-                        gettimeofday(&timenow, NULL);
-                        if (timenow.tv_sec - header.time.tv_sec < 3) {
-                            if ((remainder = len%4) != 0) {
-                                fb_display_pic((void *)(buf_start+sizeof(header)), fb_start, header.width, header.height, 300, 0, 0, len-sizeof(header)-remainder);
-                                for (int i=0; i<remainder; i++) {
-                                    *(buf-1-i) = buf[len-1-i];
-                                }
-                            }
-                            else {
-                                fb_display_pic((void *)(buf_start+sizeof(header)), fb_start, header.width, header.height, 300, 0, 0, len-sizeof(header));
-                            }
-                        }
-                    }
-                    else {
-                        if (timenow.tv_sec - header.time.tv_sec < 3) {
-                            int tmp = remainder;
-                            if ((remainder = (len+remainder)%4) != 0) {
-                                fb_display_pic((void *)(buf_start-tmp), fb_start, header.width, header.height, 300, 0, (header.width * header.height * 2 - pic_size), len+tmp-remainder);
-                            }
-                            else {
-                                fb_display_pic((void *)(buf_start-tmp), fb_start, header.width, header.height, 300, 0, (header.width * header.height * 2 -pic_size), len+tmp);
-                            }
-                        }
-                    }
-                    pic_size -= len;
-                    if (pic_size >= 60000) {
-                        buf_size = 60000;
-                    }
-                    else if (pic_size == 0) {
-                        buf_size = 60000;
-                        getheader = 0;
-                        calculate_fps();
-                    }
-                    else {
-                        buf_size = pic_size;
+            else if (tmpfd == shm_listen_fd) {
+                while ((r = shm_ring_accept(shm_listen_fd, &newring)) != -1) {
+                    if (r == 1)
+                        continue;
+                    /* table full: hang up before the ack, the sender falls back to TCP */
+                    if ((ring = shm_find(-1)) == NULL) {
+                        fprintf(stderr, "too many local senders\n");
+                        shm_ring_close(&newring);
+                        continue;
                     }
+                    *ring = newring;
+                    epoll_addfd(epfd, ring->sockfd, 1);
+                    shm_try_attach(epfd, ring, fb_start);
                 }
             }
-            else if (event.events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-
+            else if ((ring = shm_find(tmpfd)) != NULL) {
+                if (tmpfd == ring->eventfd) {
+                    shm_display_frames(ring, fb_start);
+                    continue;
+                }
+                if (ring->eventfd == -1 && (event.events & EPOLLIN))
+                    shm_try_attach(epfd, ring, fb_start);
+                if (ring->sockfd != -1 && (event.events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                    shm_ring_close(ring);
+            }
+            else if ((c = conn_get(tmpfd)) != NULL) {
+                frames = 0;
+                /* drain what is left before honouring a hangup */
+                if (event.events & EPOLLIN)
+                    frames = conn_recv(c, fb_start);
+                for (int f = 0; f < frames; f++)
+                    calculate_fps();
+                if (frames == -1 || (event.events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                    printf("sender on fd %d gone\n", tmpfd);
+                    conn_close(epfd, c);
+                }
             }
         }
     }
@@ -1,12 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include "color.h"
+#include "frame.h"
+#include "snapshot.h"
+#include "transport.h"
 #include "v4l2_api.h"
 
 #define EXEC_CMD_AND_CHECK(cmd, return_value, message) do { \
@@ -17,124 +20,99 @@
                                 printf(#message" exec.\n"); \
                             } while (0);
 
+#define CLEAR(x) (memset(&(x), 0, sizeof(x)))
+/* clear first, the padding after magic goes on the wire too */
 #define SET_HEADER(header, t, w, h) do { \
+                                CLEAR(header); \
+                                header.magic = FRAME_MAGIC; \
                                 header.time = t; \
                                 header.width = w; \
                                 header.height = h; \
                             } while(0);
 
-typedef struct RGB {
-    int r;
-    int g;
-    int b;
-} RGB;
-
-typedef struct HEADER {
-    struct timeval time;
-    int width;
-    int height;
-} Header;
-
-static inline int clip(int value, int min, int max)
-{
-    return (value > max ? max : (value < min ? min : value));
-}
-
-static inline RGB YUV_to_RGB(int y, int u, int v)
-{
-    RGB rgb;
-    int r,g,b;
-    u = u -128;
-    v = v-128;
-    r = (298 * y + 409 * v + 128) >> 8;
-    g = (298 * y - 100 * u - 208 * v + 128) >> 8;
-    b = (298 * y + 516 * u + 128) >> 8;
-    rgb.r = clip(r, 0, 255);
-    rgb.b = clip(b, 0, 255);
-    rgb.g = clip(g, 0, 255);
-    return rgb;
-}
-
-static void YUYV_to_RGB_file(const void * p, const int width, const int height, const char *filename)
-{
-    unsigned char* in = (unsigned char*)p;
-    int y0,y1,u,v;
-    RGB rgb;
-
-    FILE *outfile = fopen(filename, "wb");
-    fprintf(outfile, "P6\n%d %d\n255\n", width, height);
-    for (int y=0; y<height; y++) {
-        for (int x=0; x<width/2; x++) {
-            int tmp = x*4;
-            /* YUYV */
-            y0 = in[tmp];
-            y1 = in[tmp+2];
-            u = in[tmp+1];
-            v = in[tmp+3];
-
-            rgb = YUV_to_RGB(y0, u, v);
-            fwrite(&rgb.r, 1, 1, outfile);
-            fwrite(&rgb.g, 1, 1, outfile);
-            fwrite(&rgb.b, 1, 1, outfile);
-
-            rgb = YUV_to_RGB(y1, u, v);
-            fwrite(&rgb.r, 1, 1, outfile);
-            fwrite(&rgb.g, 1, 1, outfile);
-            fwrite(&rgb.b, 1, 1, outfile);
-        }
-        in += width*2;
-    }
-    fclose(outfile);
-}
-
-int main(void)
+int main(int argc, char *argv[])
 {
     int fd = 0, req_buffer_num = 4, width = 720, height = 600;
     char *video = "/dev/video0";
     my_buffer *bufs = NULL;
     char *pic = NULL;
-    int socketfd = -1;
-    struct sockaddr_in toaddr;
-    int len = 0, pic_size;
+    my_buffer *buf = NULL;
+    enum io_method io = IO_METHOD_MMAP;
+    int export_dmabuf = 0, opt;
+    enum color_matrix matrix = COLOR_BT601;
+    enum color_range range = COLOR_RANGE_LIMITED;
+    char *peer = "127.0.0.1";
+    transport tp;
     /* TODO: use it to make reliable header */
     struct timeval timenow;
     Header header;
 
+    /*
+     * -u: capture into our own USERPTR pool, -e: export MMAP buffers as dmabuf and print the fds
+     * -m bt601|bt709, -f: full range, how snapshots convert the camera's YUYV
+     */
+    while ((opt = getopt(argc, argv, "uem:f")) != -1) {
+        switch (opt) {
+            case 'u':
+                io = IO_METHOD_USERPTR;
+                break;
+            case 'e':
+                export_dmabuf = 1;
+                break;
+            case 'm':
+                if (color_parse_matrix(optarg, &matrix) == -1) {
+                    fprintf(stderr, "unknown color matrix %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                range = COLOR_RANGE_FULL;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-u | -e] [-m bt601|bt709] [-f] [peer ip]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc)
+        peer = argv[optind];
+
     EXEC_CMD_AND_CHECK(fd = v4l2_open_dev(video), -1, v4l2_open_dev);
-    EXEC_CMD_AND_CHECK(v4l2_init_dev(fd, &req_buffer_num, &bufs, &width, &height), -1, v4l2_init_dev);
-    EXEC_CMD_AND_CHECK(v4l2_start_capstream(fd, req_buffer_num), -1, v4l2_start_capstream);
+    EXEC_CMD_AND_CHECK(v4l2_init_dev(fd, io, &req_buffer_num, &bufs, &width, &height), -1, v4l2_init_dev);
+    if (export_dmabuf) {
+        EXEC_CMD_AND_CHECK(v4l2_export_bufs(fd, req_buffer_num, bufs), -1, v4l2_export_bufs);
+        for (int i=0; i<req_buffer_num; i++)
+            printf("buffer %d: dmabuf fd %d\n", bufs[i].index, bufs[i].dmabuf_fd);
+    }
+    EXEC_CMD_AND_CHECK(v4l2_start_capstream(fd, req_buffer_num, bufs), -1, v4l2_start_capstream);
     EXEC_CMD_AND_CHECK(pic = v4l2_getpic(fd, bufs), NULL, v4l2_getpic);
-    //YUYV_to_RGB_file(pic, width, height, "pic.ppm");
+    /* stills for the dashboard, capture goes on without them */
+    if (snapshot_start(strrchr(video, '/') + 1, width, height, matrix, range) == -1)
+        fprintf(stderr, "snapshot service not available\n");
 
-    socketfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketfd == -1) {
-        perror("socket create error!\n");
-        exit(EXIT_FAILURE);
-    }
-    toaddr.sin_family = AF_INET;
-    toaddr.sin_port = htons(8080);
-    toaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    if ((connect(socketfd, (struct sockaddr*)&toaddr, sizeof(toaddr))) == -1) {
-        perror("connect");
-        exit(EXIT_FAILURE);
-    }
+    /* connects lazily and keeps retrying, capture never waits for the receiver */
+    EXEC_CMD_AND_CHECK(transport_init(&tp, peer, 8080, req_buffer_num, width*height*2), -1, transport_init);
     while (1) {
-        EXEC_CMD_AND_CHECK(pic = (char *)v4l2_getpic(fd, bufs), NULL, v4l2_getpic);
-        pic_size = width*height*2;
-        gettimeofday(&timenow, NULL);
-        SET_HEADER(header, timenow, width, height);
-        // UDP max length is 65507
-        if ((len = send(socketfd, &header, sizeof(header), 0)) == -1) {
-            perror("sendto");
+        /*
+         * hold the buffer while it is sent so the driver can not overwrite it,
+         * no "exec." line per frame, only failures are reported
+         */
+        if ((buf = v4l2_dqbuf(fd, bufs)) == NULL) {
+            printf("v4l2_dqbuf fail.\n");
             exit(EXIT_FAILURE);
         }
-        if ((len = send(socketfd, pic, pic_size, 0)) == -1) {
-            perror("sendto");
+        pic = (char *)buf->start;
+        gettimeofday(&timenow, NULL);
+        SET_HEADER(header, timenow, width, height);
+        transport_send(&tp, &header, pic);
+        snapshot_offer(pic, &timenow);
+        if (v4l2_qbuf(fd, buf) == -1) {
+            printf("v4l2_qbuf fail.\n");
             exit(EXIT_FAILURE);
         }
     }
 
-    close(socketfd);
+    transport_close(&tp);
+    snapshot_stop();
 
     EXEC_CMD_AND_CHECK(v4l2_stop_capstream(fd), -1, v4l2_stop_capstream);
     EXEC_CMD_AND_CHECK(v4l2_munmap_bufs(req_buffer_num, &bufs), -1, v4l2_munmap_bufs);
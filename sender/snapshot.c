@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#include "color.h"
+#include "snapshot.h"
+
+#define CLEAR(x) (memset(&(x), 0, sizeof(x)))
+#define SNAPSHOT_POOL_NUM 2
+#define SNAPSHOT_PENDING_NUM 8
+#define SNAPSHOT_MAX_SCALE 16
+#define SNAPSHOT_JPEG_QUALITY 80
+#define SNAPSHOT_IO_BUF (64 * 1024)
+
+enum snapshot_format {
+    SNAPSHOT_PPM,
+    SNAPSHOT_JPEG,
+};
+
+typedef struct snapshot_req {
+    enum snapshot_format format;
+    int scale;
+    char path[256];
+    struct sockaddr_un client;
+    socklen_t client_len;
+} snapshot_req;
+
+typedef struct snapshot_slot {
+    snapshot_req req;
+    struct timeval time;
+    unsigned char *pic;
+} snapshot_slot;
+
+#ifdef HAVE_LIBJPEG
+typedef struct jpeg_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+} jpeg_error;
+#endif
+
+static void reply(int fd, const snapshot_req *req, const char *message);
+static int parse_req(const char *buf, snapshot_req *req);
+static void lower_priority(void);
+static void downsample(const unsigned char *pic, int scale, unsigned char *out);
+static int write_ppm(FILE *fp, const unsigned char *rgb, int w, int h);
+static int write_jpeg(FILE *fp, const unsigned char *rgb, int w, int h);
+static int encode(const snapshot_slot *slot);
+static void *ctrl_loop(void *arg);
+static void *worker_loop(void *arg);
+
+static int width, height, frame_size;
+static color_conv cc;
+static int ctrl_fd = -1;
+static volatile int running = 0;
+static pthread_t ctrl_thread, worker_thread;
+/* requests from the control thread, handed to the capture loop */
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static snapshot_req pending[SNAPSHOT_PENDING_NUM];
+static int pending_num = 0;
+/* frame copies, capture loop fills head, worker drains tail */
+static snapshot_slot pool[SNAPSHOT_POOL_NUM];
+static uint32_t pool_head = 0, pool_tail = 0;
+static sem_t work;
+/* worker only */
+static unsigned char *rgb = NULL, *row = NULL;
+static unsigned int *acc = NULL;
+
+static void reply(int fd, const snapshot_req *req, const char *message)
+{
+    /* unbound requesters can not be answered, that is fine */
+    if (req->client_len <= offsetof(struct sockaddr_un, sun_path))
+        return;
+    if (sendto(fd, message, strlen(message), MSG_DONTWAIT | MSG_NOSIGNAL,
+               (const struct sockaddr *)&req->client, req->client_len) == -1)
+        perror("snapshot reply");
+}
+
+/* return 0 success, return -1 fail */
+static int parse_req(const char *buf, snapshot_req *req)
+{
+    char format[8];
+    int n;
+
+    req->scale = 1;
+    n = sscanf(buf, "%7s %255s %d", format, req->path, &req->scale);
+    if (n < 2)
+        return -1;
+    if (strcmp(format, "ppm") == 0)
+        req->format = SNAPSHOT_PPM;
+#ifdef HAVE_LIBJPEG
+    else if (strcmp(format, "jpeg") == 0 || strcmp(format, "jpg") == 0)
+        req->format = SNAPSHOT_JPEG;
+#endif
+    else
+        return -1;
+    if (req->path[0] != '/' || req->scale < 1 || req->scale > SNAPSHOT_MAX_SCALE
+            || width / req->scale < 2 || height / req->scale < 1)
+        return -1;
+    return 0;
+}
+
+/* stills must never compete with capture and sending */
+static void lower_priority(void)
+{
+    struct sched_param param;
+
+    CLEAR(param);
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+        fprintf(stderr, "snapshot: SCHED_IDLE not available\n");
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) == -1)
+        perror("setpriority");
+}
+
+/* box filter scale x scale blocks, out is (width/scale) x (height/scale) RGB */
+static void downsample(const unsigned char *pic, int scale, unsigned char *out)
+{
+    int ow = width / scale, oh = height / scale;
+    int area = scale * scale;
+
+    if (scale == 1) {
+        for (int y=0; y<height; y++)
+            color_yuyv_to_rgb24(&cc, pic + y * width * 2, out + y * width * 3, width & ~1);
+        return;
+    }
+    for (int oy=0; oy<oh; oy++) {
+        memset(acc, 0, ow * 3 * sizeof(*acc));
+        for (int sy=0; sy<scale; sy++) {
+            color_yuyv_to_rgb24(&cc, pic + (oy * scale + sy) * width * 2, row, width & ~1);
+            for (int ox=0; ox<ow; ox++) {
+                const unsigned char *in = row + ox * scale * 3;
+                unsigned int *sum = acc + ox * 3;
+                for (int sx=0; sx<scale; sx++, in+=3) {
+                    sum[0] += in[0];
+                    sum[1] += in[1];
+                    sum[2] += in[2];
+                }
+            }
+        }
+        for (int i=0; i<ow*3; i++)
+            *out++ = (acc[i] + area / 2) / area;
+    }
+}
+
+static int write_ppm(FILE *fp, const unsigned char *rgb, int w, int h)
+{
+    fprintf(fp, "P6\n%d %d\n255\n", w, h);
+    if (fwrite(rgb, 3 * w, h, fp) != h)
+        return -1;
+    return 0;
+}
+
+#ifdef HAVE_LIBJPEG
+/* the default handler calls exit(), a bad still must not kill the sender */
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    jpeg_error *err = (jpeg_error *)cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->jmp, 1);
+}
+
+static int write_jpeg(FILE *fp, const unsigned char *rgb, int w, int h)
+{
+    struct jpeg_compress_struct cinfo;
+    jpeg_error err;
+    JSAMPROW line;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(err.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        return -1;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, SNAPSHOT_JPEG_QUALITY, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        line = (JSAMPROW)(rgb + cinfo.next_scanline * w * 3);
+        jpeg_write_scanlines(&cinfo, &line, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+#else
+static int write_jpeg(FILE *fp, const unsigned char *rgb, int w, int h)
+{
+    return -1;
+}
+#endif
+
+/* return 0 success, return -1 fail */
+static int encode(const snapshot_slot *slot)
+{
+    const snapshot_req *req = &slot->req;
+    int w = width / req->scale, h = height / req->scale;
+    char tmp[sizeof(req->path) + 8];
+    FILE *fp;
+    int fd, r;
+
+    downsample(slot->pic, req->scale, rgb);
+    /*
+     * write aside and rename, readers never see half a picture. mkstemp
+     * picks a fresh name with O_EXCL, a planted file or symlink is never
+     * followed even though we usually run as root.
+     */
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", req->path);
+    if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1) {
+        perror("snapshot mkstemp");
+        return -1;
+    }
+    if (fchmod(fd, 0644) == -1 || (fp = fdopen(fd, "wb")) == NULL) {
+        perror("snapshot fdopen");
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, SNAPSHOT_IO_BUF);
+    if (req->format == SNAPSHOT_JPEG)
+        r = write_jpeg(fp, rgb, w, h);
+    else
+        r = write_ppm(fp, rgb, w, h);
+    /* mtime tells when the frame was taken, not when the idle thread got to it */
+    if (r == 0 && (fflush(fp) == EOF
+            || futimes(fd, (struct timeval [2]){ slot->time, slot->time }) == -1))
+        perror("snapshot futimes");
+    if (fclose(fp) == EOF)
+        r = -1;
+    if (r == 0 && rename(tmp, req->path) == -1) {
+        perror("snapshot rename");
+        r = -1;
+    }
+    if (r == -1)
+        unlink(tmp);
+    return r;
+}
+
+static void *ctrl_loop(void *arg)
+{
+    char buf[512];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct ucred))];
+        struct cmsghdr align;
+    } u;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct ucred *cred;
+    snapshot_req req;
+    ssize_t len;
+
+    lower_priority();
+    while (running) {
+        CLEAR(msg);
+        CLEAR(req);
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf) - 1;
+        msg.msg_name = &req.client;
+        msg.msg_namelen = sizeof(req.client);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        /* times out now and then so snapshot_stop is noticed */
+        if ((len = recvmsg(ctrl_fd, &msg, 0)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("snapshot recvmsg");
+            continue;
+        }
+        buf[len] = '\0';
+        req.client_len = msg.msg_namelen;
+        /* abstract sockets have no permissions, only our own user may ask */
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
+            reply(ctrl_fd, &req, "error no credentials\n");
+            continue;
+        }
+        cred = (struct ucred *)CMSG_DATA(cmsg);
+        if (cred->uid != 0 && cred->uid != geteuid()) {
+            reply(ctrl_fd, &req, "error permission denied\n");
+            continue;
+        }
+        if (parse_req(buf, &req) == -1) {
+            reply(ctrl_fd, &req, "error usage: <ppm|jpeg> <absolute path> [scale 1..16]\n");
+            continue;
+        }
+        pthread_mutex_lock(&pending_lock);
+        if (pending_num < SNAPSHOT_PENDING_NUM) {
+            pending[pending_num] = req;
+            __atomic_store_n(&pending_num, pending_num + 1, __ATOMIC_RELEASE);
+            req.client_len = 0;
+        }
+        pthread_mutex_unlock(&pending_lock);
+        if (req.client_len)
+            reply(ctrl_fd, &req, "error busy\n");
+    }
+    return NULL;
+}
+
+static void *worker_loop(void *arg)
+{
+    snapshot_slot *slot;
+    char message[sizeof(slot->req.path) + 48];
+
+    lower_priority();
+    while (1) {
+        if (sem_wait(&work) == -1)
+            continue;
+        if (!running)
+            break;
+        slot = &pool[pool_tail % SNAPSHOT_POOL_NUM];
+        if (encode(slot) == 0)
+            snprintf(message, sizeof(message), "ok %s %ld.%06ld\n", slot->req.path,
+                     (long)slot->time.tv_sec, (long)slot->time.tv_usec);
+        else
+            snprintf(message, sizeof(message), "error %s\n", slot->req.path);
+        reply(ctrl_fd, &slot->req, message);
+        __atomic_store_n(&pool_tail, pool_tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int snapshot_start(const char *name, int w, int h,
+                   enum color_matrix matrix, enum color_range range)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout = { 0, 200 * 1000 };
+    int flag = 1;
+
+    width = w;
+    height = h;
+    frame_size = w * h * 2;
+    color_conv_init(&cc, matrix, range);
+    for (int i=0; i<SNAPSHOT_POOL_NUM; i++) {
+        if ((pool[i].pic = (unsigned char *)malloc(frame_size)) == NULL)
+            goto nomem;
+    }
+    rgb = (unsigned char *)malloc(w * h * 3);
+    row = (unsigned char *)malloc(w * 3);
+    acc = (unsigned int *)malloc(w * 3 * sizeof(*acc));
+    if (!rgb || !row || !acc)
+        goto nomem;
+    if ((ctrl_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        goto fail;
+    }
+    CLEAR(addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "linuxls-snapshot-%s", name);
+    if (bind(ctrl_fd, (struct sockaddr *)&addr,
+             offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1)) == -1) {
+        perror("bind snapshot socket");
+        goto fail;
+    }
+    if (setsockopt(ctrl_fd, SOL_SOCKET, SO_PASSCRED, &flag, sizeof(flag)) == -1
+            || setsockopt(ctrl_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        perror("setsockopt snapshot socket");
+        goto fail;
+    }
+    if (sem_init(&work, 0, 0) == -1) {
+        perror("sem_init");
+        goto fail;
+    }
+    running = 1;
+    if (pthread_create(&worker_thread, NULL, worker_loop, NULL) != 0) {
+        fprintf(stderr, "snapshot: cannot create worker thread\n");
+        running = 0;
+        goto fail;
+    }
+    if (pthread_create(&ctrl_thread, NULL, ctrl_loop, NULL) != 0) {
+        fprintf(stderr, "snapshot: cannot create control thread\n");
+        running = 0;
+        sem_post(&work);
+        pthread_join(worker_thread, NULL);
+        goto fail;
+    }
+    printf("snapshot requests on @linuxls-snapshot-%s\n", name);
+    return 0;
+nomem:
+    fprintf(stderr, "Out of memory\n");
+fail:
+    if (ctrl_fd != -1)
+        close(ctrl_fd);
+    ctrl_fd = -1;
+    for (int i=0; i<SNAPSHOT_POOL_NUM; i++) {
+        free(pool[i].pic);
+        pool[i].pic = NULL;
+    }
+    free(rgb);
+    free(row);
+    free(acc);
+    rgb = row = NULL;
+    acc = NULL;
+    return -1;
+}
+
+void snapshot_offer(const void *pic, const struct timeval *time)
+{
+    snapshot_slot *slot;
+
+    /* the common case: nobody asked, one load and out */
+    if (!__atomic_load_n(&pending_num, __ATOMIC_ACQUIRE))
+        return;
+    /* worker still encoding every pool buffer, try again next frame */
+    if (pool_head - __atomic_load_n(&pool_tail, __ATOMIC_ACQUIRE) >= SNAPSHOT_POOL_NUM)
+        return;
+    if (pthread_mutex_trylock(&pending_lock) != 0)
+        return;
+    slot = &pool[pool_head % SNAPSHOT_POOL_NUM];
+    slot->req = pending[0];
+    memmove(pending, pending + 1, (pending_num - 1) * sizeof(pending[0]));
+    __atomic_store_n(&pending_num, pending_num - 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pending_lock);
+    memcpy(slot->pic, pic, frame_size);
+    slot->time = *time;
+    __atomic_store_n(&pool_head, pool_head + 1, __ATOMIC_RELEASE);
+    sem_post(&work);
+}
+
+void snapshot_stop(void)
+{
+    if (!running)
+        return;
+    running = 0;
+    sem_post(&work);
+    pthread_join(ctrl_thread, NULL);
+    pthread_join(worker_thread, NULL);
+    sem_destroy(&work);
+    close(ctrl_fd);
+    ctrl_fd = -1;
+    for (int i=0; i<SNAPSHOT_POOL_NUM; i++) {
+        free(pool[i].pic);
+        pool[i].pic = NULL;
+    }
+    free(rgb);
+    free(row);
+    free(acc);
+    rgb = row = NULL;
+    acc = NULL;
+}
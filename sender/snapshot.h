@@ -0,0 +1,30 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sys/time.h>
+
+#include "color.h"
+
+/*
+ * Stills on request, off the capture path. Requests arrive as one datagram
+ * on the abstract unix socket "linuxls-snapshot-<name>":
+ *
+ *     <ppm|jpeg> <absolute path> [scale 1..16]
+ *
+ * e.g. echo "jpeg /run/linuxls/cam0.jpg 4" | socat - ABSTRACT-SENDTO:linuxls-snapshot-video0
+ * The sender usually runs as root, keep stills in a directory only it can
+ * write, not in /tmp.
+ * The capture loop only copies the next frame into a pool buffer, a low
+ * priority thread downsamples and encodes it, then answers
+ * "ok <path> <sec>.<usec>" with the capture time or "error <path>" if the
+ * requester has a bound address. The file mtime is the capture time too.
+ */
+
+/* return 0 success, return -1 fail */
+int snapshot_start(const char *name, int width, int height,
+                   enum color_matrix matrix, enum color_range range);
+/* call once per captured frame, never blocks */
+void snapshot_offer(const void *pic, const struct timeval *time);
+void snapshot_stop(void);
+
+#endif
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "transport.h"
+
+#define CLEAR(x) (memset(&(x), 0, sizeof(x)))
+#define BACKOFF_MIN_MS 10
+#define BACKOFF_MAX_MS 1000
+/* a connect or shm handshake still pending after this is given up */
+#define CONNECT_TIMEOUT_MS 1000
+/* a receiver taking no bytes for this long is treated as gone */
+#define STALL_TIMEOUT_MS 2000
+
+static void time_after(struct timeval *t, const struct timeval *now, int ms);
+static int transport_connect(transport *t, const struct timeval *now);
+static int transport_finish_connect(transport *t);
+static void transport_disconnect(transport *t, int retry_now);
+static int transport_flush(transport *t, const struct timeval *now);
+
+static void time_after(struct timeval *t, const struct timeval *now, int ms)
+{
+    t->tv_sec = now->tv_sec + ms / 1000;
+    t->tv_usec = now->tv_usec + (ms % 1000) * 1000;
+    if (t->tv_usec >= 1000000) {
+        t->tv_sec++;
+        t->tv_usec -= 1000000;
+    }
+}
+
+/* start a connect, return 0 in flight, return -1 fail */
+static int transport_connect(transport *t, const struct timeval *now)
+{
+    time_after(&t->deadline, now, CONNECT_TIMEOUT_MS);
+    /* the receiver acks the ring once attached, until then it may still refuse */
+    if (t->local && !t->shm_refused
+            && shm_ring_connect(&t->ring, t->slot_num, t->frame_size) == 0) {
+        t->use_shm = 1;
+        return 0;
+    }
+    t->use_shm = 0;
+    if ((t->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(t->sockfd, (struct sockaddr *)&t->addr, sizeof(t->addr)) == -1
+            && errno != EINPROGRESS) {
+        close(t->sockfd);
+        t->sockfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* return 1 connected, return 0 still pending, return -1 fail */
+static int transport_finish_connect(transport *t)
+{
+    struct pollfd pfd;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    int r;
+
+    if (t->use_shm) {
+        if ((r = shm_ring_acked(&t->ring)) == -1) {
+            /* receiver full or foreign, do not offer it a ring again */
+            fprintf(stderr, "shm refused by receiver, use TCP\n");
+            t->shm_refused = 1;
+        }
+        return r;
+    }
+    pfd.fd = t->sockfd;
+    pfd.events = POLLOUT;
+    if ((r = poll(&pfd, 1, 0)) <= 0)
+        return r == -1 && errno != EINTR ? -1 : 0;
+    if (getsockopt(t->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+        return -1;
+    return 1;
+}
+
+static void transport_disconnect(transport *t, int retry_now)
+{
+    if (t->use_shm)
+        shm_ring_close(&t->ring);
+    else if (t->sockfd != -1)
+        close(t->sockfd);
+    t->sockfd = -1;
+    t->use_shm = 0;
+    t->state = TRANSPORT_DISCONNECTED;
+    t->backlog_len = t->backlog_off = 0;
+    /* first retry right away, a restarted receiver is usually back already */
+    if (retry_now) {
+        t->backoff_ms = 0;
+        CLEAR(t->next_retry);
+    }
+}
+
+/* push out the rest of a partly sent frame, return 0 done or pending, return -1 fail */
+static int transport_flush(transport *t, const struct timeval *now)
+{
+    ssize_t len;
+
+    while (t->backlog_off < t->backlog_len) {
+        len = send(t->sockfd, t->backlog + t->backlog_off,
+                   t->backlog_len - t->backlog_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        t->backlog_off += len;
+        t->last_progress = *now;
+    }
+    t->backlog_len = t->backlog_off = 0;
+    return 0;
+}
+
+int transport_init(transport *t, const char *peer, int port, int slot_num, int frame_size)
+{
+    CLEAR(*t);
+    t->addr.sin_family = AF_INET;
+    t->addr.sin_port = htons(port);
+    t->addr.sin_addr.s_addr = inet_addr(peer);
+    /* same host: hand frames over through shared memory, skip loopback TCP */
+    t->local = (ntohl(t->addr.sin_addr.s_addr) >> 24) == 127;
+    t->slot_num = slot_num;
+    t->frame_size = frame_size;
+    t->state = TRANSPORT_DISCONNECTED;
+    t->sockfd = -1;
+    t->ring.base = NULL;
+    t->ring.memfd = t->ring.eventfd = t->ring.sockfd = -1;
+    if ((t->backlog = (char *)malloc(sizeof(Header) + frame_size)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+int transport_send(transport *t, const Header *header, const void *pic)
+{
+    struct timeval timenow, stall;
+    struct iovec iov[2];
+    struct msghdr msg;
+    shm_slot *slot;
+    size_t total = sizeof(*header) + t->frame_size;
+    ssize_t len;
+    int r;
+
+    gettimeofday(&timenow, NULL);
+    if (t->state == TRANSPORT_DISCONNECTED) {
+        if (timercmp(&timenow, &t->next_retry, <))
+            return 0;
+        if (transport_connect(t, &timenow) == -1)
+            goto connect_fail;
+        t->state = TRANSPORT_CONNECTING;
+    }
+    if (t->state == TRANSPORT_CONNECTING) {
+        if ((r = transport_finish_connect(t)) == 0) {
+            if (timercmp(&timenow, &t->deadline, <))
+                return 0;
+            r = -1;
+        }
+        if (r == -1) {
+            /* shm refused: fall back to TCP on the next frame, no backoff */
+            if (t->use_shm && t->shm_refused) {
+                transport_disconnect(t, 1);
+                return 0;
+            }
+            transport_disconnect(t, 0);
+            goto connect_fail;
+        }
+        t->state = TRANSPORT_CONNECTED;
+        t->backoff_ms = 0;
+        t->last_progress = timenow;
+        printf("connected to receiver by %s.\n", t->use_shm ? "shm" : "TCP");
+    }
+    if (t->use_shm) {
+        if (shm_ring_peer_closed(&t->ring)) {
+            fprintf(stderr, "shm receiver closed, reconnect\n");
+            transport_disconnect(t, 1);
+            return 0;
+        }
+        /* ring full: receiver is behind, drop this frame */
+        if ((slot = shm_ring_get_write_slot(&t->ring)) == NULL)
+            return 0;
+        slot->time = header->time;
+        slot->width = header->width;
+        slot->height = header->height;
+        slot->length = t->frame_size;
+        memcpy(slot->data, pic, t->frame_size);
+        shm_ring_publish(&t->ring);
+        return 1;
+    }
+    if (transport_flush(t, &timenow) == -1)
+        goto send_fail;
+    if (t->backlog_len == 0) {
+        /* header and picture in one call, never wait for the socket */
+        iov[0].iov_base = (void *)header;
+        iov[0].iov_len = sizeof(*header);
+        iov[1].iov_base = (void *)pic;
+        iov[1].iov_len = t->frame_size;
+        CLEAR(msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        while ((len = sendmsg(t->sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1
+                && errno == EINTR)
+            ;
+        if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            goto send_fail;
+        if (len > 0) {
+            t->last_progress = timenow;
+            /* the frame is started, keep the rest, the buffer goes back to the driver */
+            if ((size_t)len < total) {
+                if ((size_t)len < sizeof(*header)) {
+                    memcpy(t->backlog, (const char *)header + len, sizeof(*header) - len);
+                    memcpy(t->backlog + sizeof(*header) - len, pic, t->frame_size);
+                }
+                else
+                    memcpy(t->backlog, (const char *)pic + len - sizeof(*header), total - len);
+                t->backlog_len = total - len;
+            }
+            return 1;
+        }
+    }
+    /* socket full: receiver is behind, drop this frame */
+    time_after(&stall, &t->last_progress, STALL_TIMEOUT_MS);
+    if (timercmp(&timenow, &stall, >=)) {
+        /* stuck, not dead: back off instead of reconnecting every frame */
+        fprintf(stderr, "receiver stalled, reconnect\n");
+        transport_disconnect(t, 0);
+        goto connect_fail;
+    }
+    return 0;
+
+send_fail:
+    /* the receiver drops the half sent frame along with the old connection */
+    perror("send, reconnect");
+    t->shm_refused = 0;
+    transport_disconnect(t, 1);
+    return 0;
+
+connect_fail:
+    /* a refused ring may be accepted by the next receiver */
+    t->shm_refused = 0;
+    if (t->backoff_ms == 0)
+        t->backoff_ms = BACKOFF_MIN_MS;
+    else if ((t->backoff_ms *= 2) > BACKOFF_MAX_MS)
+        t->backoff_ms = BACKOFF_MAX_MS;
+    time_after(&t->next_retry, &timenow, t->backoff_ms);
+    return 0;
+}
+
+void transport_close(transport *t)
+{
+    if (t->state != TRANSPORT_DISCONNECTED)
+        transport_disconnect(t, 1);
+    free(t->backlog);
+    t->backlog = NULL;
+}
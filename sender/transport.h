@@ -0,0 +1,50 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+#include "frame.h"
+#include "shm_ring.h"
+
+/*
+ * Carries frames to the receiver, shared memory when it runs on this host
+ * and TCP otherwise. Nothing here blocks the capture thread: connects are
+ * non blocking and finished on later calls, a slow receiver gets frames
+ * dropped, and a lost peer is retried with exponential backoff.
+ */
+
+enum transport_state {
+    TRANSPORT_DISCONNECTED,
+    TRANSPORT_CONNECTING,   /* TCP connect in flight or waiting for the shm ack */
+    TRANSPORT_CONNECTED,
+};
+
+typedef struct transport {
+    struct sockaddr_in addr;
+    int local;          /* peer is on this host, try shm first */
+    int shm_refused;    /* receiver hung up before the ack, use TCP until that drops */
+    int slot_num;
+    int frame_size;
+    enum transport_state state;
+    int use_shm;
+    shm_ring ring;
+    int sockfd;
+    int backoff_ms;
+    struct timeval next_retry;
+    struct timeval deadline;        /* pending connect gives up here */
+    struct timeval last_progress;   /* last time the socket took bytes */
+    /* rest of a frame the socket did not take at once */
+    char *backlog;
+    size_t backlog_len;
+    size_t backlog_off;
+} transport;
+
+/* return 0 success, return -1 fail */
+int transport_init(transport *t, const char *peer, int port, int slot_num, int frame_size);
+/* return 1 frame sent or queued, return 0 frame dropped (not connected or peer busy) */
+int transport_send(transport *t, const Header *header, const void *pic);
+void transport_close(transport *t);
+
+#endif
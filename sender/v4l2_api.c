@@ -12,8 +12,17 @@
 #include "v4l2_api.h"
 
 #define CLEAR(x) (memset(&(x), 0, sizeof(x)))
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
 
 static int xioctl(int fd, int request, void *arg);
+static int init_mmap(int fd, int *req_buffer_num, my_buffer **bufs);
+static int init_userptr(int fd, int *req_buffer_num, my_buffer **bufs, size_t buffer_size);
+
+static enum io_method io_method = IO_METHOD_MMAP;
+/* USERPTR: every buffer lives in this one mapping */
+static void *pool_start = NULL;
+static size_t pool_size = 0;
 
 static int xioctl(int fd, int request, void *arg)
 {
@@ -92,6 +101,8 @@ static int init_mmap(int fd, int *req_buffer_num, my_buffer **bufs)
             perror("VIDIOC_QUERYBUF");
             return -1;
         }
+        (*bufs+i)->index = i;
+        (*bufs+i)->dmabuf_fd = -1;
         (*bufs+i)->length = v4l2_buf.length;
         (*bufs+i)->start = mmap(NULL, v4l2_buf.length, PROT_READ|PROT_WRITE
                                 , MAP_SHARED, fd, v4l2_buf.m.offset);
@@ -103,7 +114,64 @@ static int init_mmap(int fd, int *req_buffer_num, my_buffer **bufs)
     return 1;
 }
 
-int v4l2_init_dev(int fd, int *req_buffer_num, my_buffer **bufs, int *width, int *height)
+static int init_userptr(int fd, int *req_buffer_num, my_buffer **bufs, size_t buffer_size)
+{
+    struct v4l2_requestbuffers req;
+    size_t stride = ALIGN_UP(buffer_size, getpagesize());
+
+    CLEAR(req);
+    req.count = *req_buffer_num;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "device does not support user pointer i/o\n");
+            return -1;
+        } else {
+            perror("VIDIOC_REQBUFS");
+            return -1;
+        }
+    }
+    /* the driver may grant fewer, queueing an index past req.count fails */
+    if (req.count < *req_buffer_num) {
+        if (req.count > 0) {
+            fprintf(stderr, "just request %d buffers memory on device\n", *req_buffer_num);
+            *req_buffer_num = req.count;
+        } else {
+            fprintf(stderr, "insufficient buffer memory on device\n");
+            return -1;
+        }
+    }
+    *bufs = (my_buffer *)calloc(*req_buffer_num, sizeof(my_buffer));
+    if (!(*bufs)) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    /* try explicit hugepages first, then ask THP to back a normal mapping */
+    pool_size = ALIGN_UP(stride * *req_buffer_num, HUGE_PAGE_SIZE);
+    pool_start = mmap(NULL, pool_size, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+    if (pool_start == MAP_FAILED) {
+        pool_start = mmap(NULL, pool_size, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (pool_start == MAP_FAILED) {
+            perror("mmap buffer pool");
+            pool_start = NULL;
+            return -1;
+        }
+        if (madvise(pool_start, pool_size, MADV_HUGEPAGE) == -1)
+            perror("madvise MADV_HUGEPAGE");
+    }
+    for (int i=0; i<*req_buffer_num; i++) {
+        (*bufs+i)->index = i;
+        (*bufs+i)->dmabuf_fd = -1;
+        (*bufs+i)->length = buffer_size;
+        (*bufs+i)->start = (char *)pool_start + i * stride;
+    }
+    return 1;
+}
+
+int v4l2_init_dev(int fd, enum io_method io, int *req_buffer_num, my_buffer **bufs, int *width, int *height)
 {
     struct v4l2_capability cap;
     struct v4l2_format fmt;
@@ -157,27 +225,54 @@ int v4l2_init_dev(int fd, int *req_buffer_num, my_buffer **bufs, int *width, int
     }
     *width = fmt.fmt.pix.width;
     *height = fmt.fmt.pix.height;
-    if (init_mmap(fd, req_buffer_num, bufs) == -1) {
-        fprintf(stderr, "init_mmap fail\n");
+    io_method = io;
+    switch (io_method) {
+        case IO_METHOD_USERPTR:
+            if (init_userptr(fd, req_buffer_num, bufs, fmt.fmt.pix.sizeimage) == -1) {
+                fprintf(stderr, "init_userptr fail\n");
+                return -1;
+            }
+            break;
+        case IO_METHOD_MMAP:
+        default:
+            if (init_mmap(fd, req_buffer_num, bufs) == -1) {
+                fprintf(stderr, "init_mmap fail\n");
+                return -1;
+            }
+            break;
+    }
+    return 1;
+}
+
+int v4l2_export_bufs(int fd, int req_buffer_num, my_buffer *bufs)
+{
+    if (io_method != IO_METHOD_MMAP) {
+        fprintf(stderr, "only mmap buffers can be exported\n");
         return -1;
     }
+    for (int i=0; i<req_buffer_num; i++) {
+        struct v4l2_exportbuffer expbuf;
+
+        CLEAR(expbuf);
+        expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        expbuf.index = bufs[i].index;
+        expbuf.flags = O_CLOEXEC | O_RDONLY;
+        /* VIDIOC_EXPBUF: get a dmabuf fd other processes and devices can map */
+        if (xioctl(fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+            perror("VIDIOC_EXPBUF");
+            return -1;
+        }
+        bufs[i].dmabuf_fd = expbuf.fd;
+    }
     return 1;
 }
 
-int v4l2_start_capstream(int fd, int req_buffer_num)
+int v4l2_start_capstream(int fd, int req_buffer_num, my_buffer *bufs)
 {
     enum v4l2_buf_type type;
 
-    for (int i=0; i<req_buffer_num; ++i) {
-        struct v4l2_buffer buf;
-        CLEAR (buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
-        /* VIDIOC_QBU */
-        if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
-            perror("VIDIOC_QBUF");
-    }
+    for (int i=0; i<req_buffer_num; ++i)
+        v4l2_qbuf(fd, &bufs[i]);
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     /* VIDIOC_STREAMON: video stream on */
     if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
@@ -187,13 +282,13 @@ int v4l2_start_capstream(int fd, int req_buffer_num)
     return 1;
 }
 
-void *v4l2_getpic(int fd, my_buffer *bufs)
+my_buffer *v4l2_dqbuf(int fd, my_buffer *bufs)
 {
     struct v4l2_buffer v4l2_buf;
 
     CLEAR (v4l2_buf);
     v4l2_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_buf.memory = V4L2_MEMORY_MMAP;
+    v4l2_buf.memory = io_method == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
     while (1) {
         /* VIDIOC_DQBUF */
         if (xioctl (fd, VIDIOC_DQBUF, &v4l2_buf) == -1) {
@@ -208,12 +303,40 @@ void *v4l2_getpic(int fd, my_buffer *bufs)
         }
         break;
     }
+    return &bufs[v4l2_buf.index];
+}
+
+int v4l2_qbuf(int fd, my_buffer *buf)
+{
+    struct v4l2_buffer v4l2_buf;
+
+    CLEAR (v4l2_buf);
+    v4l2_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    v4l2_buf.index = buf->index;
+    if (io_method == IO_METHOD_USERPTR) {
+        v4l2_buf.memory = V4L2_MEMORY_USERPTR;
+        v4l2_buf.m.userptr = (unsigned long)buf->start;
+        v4l2_buf.length = buf->length;
+    } else {
+        v4l2_buf.memory = V4L2_MEMORY_MMAP;
+    }
     /* VIDIOC_QBUF */
     if (-1 == xioctl (fd, VIDIOC_QBUF, &v4l2_buf)) {
         perror("VIDIOC_QBUF");
-        return NULL;
+        return -1;
     }
-    return (bufs[v4l2_buf.index].start);
+    return 1;
+}
+
+void *v4l2_getpic(int fd, my_buffer *bufs)
+{
+    my_buffer *buf;
+
+    if ((buf = v4l2_dqbuf(fd, bufs)) == NULL)
+        return NULL;
+    if (v4l2_qbuf(fd, buf) == -1)
+        return NULL;
+    return buf->start;
 }
 
 int v4l2_stop_capstream(int fd)
@@ -231,7 +354,18 @@ int v4l2_stop_capstream(int fd)
 
 int v4l2_munmap_bufs(int req_buffer_num, my_buffer **bufs)
 {
+    if (io_method == IO_METHOD_USERPTR) {
+        if (pool_start && munmap(pool_start, pool_size) == -1) {
+            perror("munmap buffer pool");
+            return -1;
+        }
+        pool_start = NULL;
+        free(*bufs);
+        return 1;
+    }
     for (int i=0; i<req_buffer_num; i++) {
+        if ((*bufs+i)->dmabuf_fd != -1)
+            close((*bufs+i)->dmabuf_fd);
         if (munmap((*bufs+i)->start, (*bufs+i)->length) == -1) {
             perror("munmap");
             return -1;
@@ -1,15 +1,38 @@
 #ifndef V4L2_API_H
 #define V4L2_API_H
 
+#include <stddef.h>
+
+/*
+ * IO_METHOD_MMAP: driver owned buffers mapped into the process,
+ *                 can be exported as dmabuf fds with v4l2_export_bufs.
+ *                 The fds are only handed out here, no transport consumes
+ *                 them yet: frames are still copied into the shm ring.
+ * IO_METHOD_USERPTR: the driver captures straight into one pooled,
+ *                    hugepage backed area we allocate ourselves.
+ */
+enum io_method {
+    IO_METHOD_MMAP,
+    IO_METHOD_USERPTR,
+};
+
 typedef struct my_buffer {
     void *start;
     size_t length;
+    int index;
+    int dmabuf_fd; /* -1 unless exported */
 } my_buffer;
 
 /* return open fd */
 int v4l2_open_dev(char *video);
-int v4l2_init_dev(int fd, int *req_buffer_num, my_buffer **bufs, int *width, int *height);
-int v4l2_start_capstream(int fd, int req_buffer_num);
+int v4l2_init_dev(int fd, enum io_method io, int *req_buffer_num, my_buffer **bufs, int *width, int *height);
+/* VIDIOC_EXPBUF every buffer into bufs[i].dmabuf_fd, only for IO_METHOD_MMAP */
+int v4l2_export_bufs(int fd, int req_buffer_num, my_buffer *bufs);
+int v4l2_start_capstream(int fd, int req_buffer_num, my_buffer *bufs);
+/* dequeue a filled buffer, the caller owns it until v4l2_qbuf */
+my_buffer *v4l2_dqbuf(int fd, my_buffer *bufs);
+int v4l2_qbuf(int fd, my_buffer *buf);
+/* dequeue and requeue at once, the data may be overwritten any time */
 void *v4l2_getpic(int fd, my_buffer *bufs);
 int v4l2_stop_capstream(int fd);
 int v4l2_munmap_bufs(int req_buffer_num, my_buffer **bufs);